@@ -21,10 +21,27 @@
 
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef C2Q_DISPATCH
+#include <stdlib.h>
+#endif
+#include "cubic2quad.h"
 
 #define UNUSED(x) (void)(x)
 #define PRECISION 1e-8
 
+#ifdef C2Q_STATS
+#ifdef C2Q_KERNEL
+extern C2QStats c2q_stats;
+#else
+C2QStats c2q_stats;
+#endif
+#define COUNT(field) (c2q_stats.field++)
+#else
+#define COUNT(field)
+#endif
+
 typedef struct {
 	double x;
 	double y;
@@ -223,6 +240,8 @@ static double min_distance_to_quad(
 	// So to find the minimal distance one have to just pick the minimum value of
 	// the distance on set {t = 0 | t = 1 | t is root of the equation from [0, 1] }.
 
+	COUNT(distanceChecks);
+
 	const Point a = p_sub(p_add(p1, p2), p_mul(c1, 2));
 	const Point b = p_mul(p_sub(c1, p1), 2);
 	const Point c = p1;
@@ -297,6 +316,11 @@ static void process_segment(
 	out->c1 = p_new(cx, cy);
 }
 
+// Number of points + 1 in the grid sampled on each segment by is_segment_approximation_close(),
+// and how far beyond errorBound its control point bound must be to check around the worst one.
+#define GRID_SAMPLES (10)
+#define REFINE_RATIO (4)
+
 static bool is_segment_approximation_close(
 	const Point a, const Point b, const Point c, const Point d,
 	double tmin, double tmax,
@@ -318,15 +342,55 @@ static bool is_segment_approximation_close(
 	//   the quadratic curve and looking for the closest points on the cubic curve
 	// But this method allows easy estimation of approximation error, so it is enough
 	// for practical purposes.
+	//
+	// Before sampling, bracket the error from above: for t in [tmin, tmax] the cubic segment and the
+	// quadratic degree elevated to a cubic are both the same Bernstein-weighted sum of their four
+	// control points, so the distance between them never exceeds the largest distance between
+	// corresponding control points. If that is within errorBound no sampling is needed at all.
+
+	const double h = tmax - tmin;
+	const Point q0 = calc_point(a, b, c, d, tmin);
+	const Point q3 = calc_point(a, b, c, d, tmax);
+	const Point q1 = p_add(q0, p_mul(calc_point_derivative(a, b, c, d, tmin), h / 3));
+	const Point q2 = p_sub(q3, p_mul(calc_point_derivative(a, b, c, d, tmax), h / 3));
+	const double bound = fmax(
+		fmax(p_dist(p_sub(q0, p1)), p_dist(p_sub(q3, p2))),
+		fmax(p_dist(p_sub(q1, p_add(p1, p_mul(p_sub(c1, p1), 2.0 / 3.0)))),
+		     p_dist(p_sub(q2, p_add(p2, p_mul(p_sub(c1, p2), 2.0 / 3.0))))));
+	if (bound <= errorBound) {
+		return true;
+	}
 
-	const int n = 10; // number of points + 1
-	const double dt = (tmax - tmin) / n;
-	for (double t = tmin + dt; t < tmax - dt; t += dt) { // don't check distance on boundary points
-	                                                     // because they should be the same
-		const Point point = calc_point(a, b, c, d, t);
-		if (min_distance_to_quad(point, p1, c1, p2) > errorBound) {
+	// Otherwise sample a grid of points, visiting them from the middle outwards, where the error
+	// usually peaks, to reject bad approximations after as few evaluations as possible. Boundary
+	// points are skipped because they should be the same.
+	const int n = GRID_SAMPLES; // number of points + 1
+	const double dt = h / n;
+	double worstDistance = 0;
+	int worst = n/2;
+	for (int k = 1; k < n; k++) {
+		const int i = n/2 + ((k % 2) ? k/2 : -(k/2));
+		const Point point = calc_point(a, b, c, d, tmin + i * dt);
+		const double distance = min_distance_to_quad(point, p1, c1, p2);
+		if (distance > errorBound) {
 			return false;
 		}
+		if (distance > worstDistance) {
+			worstDistance = distance;
+			worst = i;
+		}
+	}
+
+	// Long or sharply curving segments, which stray far from the quadratic relative to
+	// errorBound, can have a narrow error peak between two grid points, so also check halfway
+	// to the neighbours of the worst point before accepting.
+	if (bound > REFINE_RATIO * errorBound) {
+		for (int side = -1; side <= 1; side += 2) {
+			const Point point = calc_point(a, b, c, d, tmin + (worst + 0.5 * side) * dt);
+			if (min_distance_to_quad(point, p1, c1, p2) > errorBound) {
+				return false;
+			}
+		}
 	}
 	return true;
 }
@@ -385,8 +449,9 @@ static void subdivide_cubic(const CBezier *b, const double t, CBezier out[2])
 /*
  * Find inflection points on a cubic curve, algorithm is similar to this one:
  * http://www.caffeineowl.com/graphics/2d/vectorial/cubic-inflexion.html
+ * The inflections are the roots of p*t^2 + q*t + r = 0.
  */
-static int solve_inflections(const CBezier *b, double out[MAX_INFLECTIONS])
+static void calc_inflection_coefficients(const CBezier *b, double out[3])
 {
 	const double
 		x1 = b->p1.x, y1 = b->p1.y,
@@ -398,9 +463,15 @@ static int solve_inflections(const CBezier *b, double out[MAX_INFLECTIONS])
 	           + x1 * (y2 - 2 * y3 + y4) - x2 * (y1 - 3 * y3 + 2 * y4);
 	const double q = x4 * (y1 - y2) + 3 * x3 * (-y1 + y2) + x2 * (2 * y1 - 3 * y3 + y4) - x1 * (2 * y2 - 3 * y3 + y4);
 	const double r = x3 * (y1 - y2) + x1 * (y2 - y3) + x2 * (-y1 + y3);
+	out[0] = p;
+	out[1] = q;
+	out[2] = r;
+}
 
+static int find_inflections(const double coefficients[3], double out[MAX_INFLECTIONS])
+{
 	double roots[2];
-	const int nroots = quad_solve(p, q, r, roots);
+	const int nroots = quad_solve(coefficients[0], coefficients[1], coefficients[2], roots);
 
 	out[0] = 0;
 	out[1] = 0;
@@ -421,8 +492,93 @@ static int solve_inflections(const CBezier *b, double out[MAX_INFLECTIONS])
 	return ni;
 }
 
+typedef enum {
+	CUBIC_POINT,   // all points are the same
+	CUBIC_LINE,    // all points on the segment from p1 to p2
+	CUBIC_QUAD,    // degree elevated quadratic
+	CUBIC_CUSP,    // a single inflection, where the derivative vanishes
+	CUBIC_GENERAL,
+} CubicClass;
+
+/*
+ * Classify the degenerate cubic curves that can be converted without solving for inflections or
+ * checking any error. coefficients receives the inflection coefficients for CUBIC_CUSP and
+ * CUBIC_GENERAL, and quad the single quadratic for the others.
+ */
+static CubicClass classify_cubic(const CBezier *cb, double coefficients[3], QBezier *quad)
+{
+	const Point chord = p_sub(cb->p2, cb->p1);
+	const Point d1 = p_sub(cb->c1, cb->p1);
+	const Point d2 = p_sub(cb->c2, cb->p1);
+	const double chordSqr = p_sqr(chord);
+
+	quad->p1 = cb->p1;
+	quad->p2 = cb->p2;
+
+	if (chordSqr < PRECISION*PRECISION) {
+		if (p_sqr(d1) < PRECISION*PRECISION && p_sqr(d2) < PRECISION*PRECISION) {
+			quad->c1 = p_div(p_add(cb->p1, cb->p2), 2);
+			return CUBIC_POINT;
+		}
+	} else {
+		// distances of the control points from the line through p1 and p2, and their
+		// positions along it; if both are within the segment the curve can only trace
+		// back and forth over it
+		const double chordLen = sqrt(chordSqr);
+		const double dist1 = fabs(d1.x*chord.y - d1.y*chord.x) / chordLen;
+		const double dist2 = fabs(d2.x*chord.y - d2.y*chord.x) / chordLen;
+		const double u1 = p_dot(d1, chord) / chordSqr;
+		const double u2 = p_dot(d2, chord) / chordSqr;
+		if (dist1 < PRECISION && dist2 < PRECISION &&
+			u1 >= 0 && u1 <= 1 && u2 >= 0 && u2 <= 1) {
+			quad->c1 = p_div(p_add(cb->p1, cb->p2), 2);
+			return CUBIC_LINE;
+		}
+	}
+
+	// a quadratic with control point q elevated to a cubic has
+	// c1 = p1 + 2/3*(q - p1) and c2 = p2 + 2/3*(q - p2)
+	const Point q1 = p_div(p_sub(p_mul(cb->c1, 3), cb->p1), 2);
+	const Point q2 = p_div(p_sub(p_mul(cb->c2, 3), cb->p2), 2);
+	if (p_sqr(p_sub(q1, q2)) < PRECISION*PRECISION) {
+		quad->c1 = p_div(p_add(q1, q2), 2);
+		return CUBIC_QUAD;
+	}
+
+	// same as the double root case of quad_solve()
+	calc_inflection_coefficients(cb, coefficients);
+	const double p = coefficients[0], q = coefficients[1], r = coefficients[2];
+	if (fabs(p) >= PRECISION && fabs(q*q - 4*p*r) < PRECISION) {
+		const double t = -q / (2*p);
+		if (t > PRECISION && t < 1 - PRECISION) {
+			return CUBIC_CUSP;
+		}
+	}
+	return CUBIC_GENERAL;
+}
+
 #define MAX_SEGMENTS (8)
 
+static bool approximate_segments(
+	const CBezier *cb, const Point a, const Point b, const Point c, const Point d,
+	const int segmentsCount, const double errorBound, QBezier *approximation)
+{
+	// a,b,c,d are the power coefficients of cb
+	// Splits cb into segmentsCount quadratic curves and checks whether they are close
+	// enough to it
+	for (int i = 0; i < segmentsCount; i++) {
+		double t = (double)i/(double)segmentsCount;
+		process_segment(a, b, c, d, t, t + 1.0/(double)segmentsCount, &approximation[i]);
+	}
+	if (segmentsCount == 1 && (
+		p_dot(p_sub(approximation[0].c1, cb->p1), p_sub(cb->c1, cb->p1)) < 0 ||
+		p_dot(p_sub(approximation[0].c1, cb->p2), p_sub(cb->c2, cb->p2)) < 0)) {
+		// approximation concave, while the curve is convex (or vice versa)
+		return false;
+	}
+	return _is_approximation_close(a, b, c, d, approximation, segmentsCount, errorBound);
+}
+
 /*
  * Approximate cubic Bezier curve defined with base points p1, p2 and control points c1, c2 with
  * with a few quadratic Bezier curves.
@@ -436,19 +592,8 @@ static int _cubic_to_quad(const CBezier *cb, double errorBound, QBezier approxim
 	calc_power_coefficients(cb->p1, cb->c1, cb->c2, cb->p2, pc);
 	const Point a = pc[0], b = pc[1], c = pc[2], d = pc[3];
 
-	int segmentsCount = 1;
-	for (; segmentsCount <= MAX_SEGMENTS; segmentsCount++) {
-		for (int i = 0; i < segmentsCount; i++) {
-			double t = (double)i/(double)segmentsCount;
-			process_segment(a, b, c, d, t, t + 1.0/(double)segmentsCount, &approximation[i]);
-		}
-		if (segmentsCount == 1 && (
-			p_dot(p_sub(approximation[0].c1, cb->p1), p_sub(cb->c1, cb->p1)) < 0 ||
-			p_dot(p_sub(approximation[0].c1, cb->p2), p_sub(cb->c2, cb->p2)) < 0)) {
-			// approximation concave, while the curve is convex (or vice versa)
-			continue;
-		}
-		if (_is_approximation_close(a, b, c, d, approximation, segmentsCount, errorBound)) {
+	for (int segmentsCount = 1; segmentsCount <= MAX_SEGMENTS; segmentsCount++) {
+		if (approximate_segments(cb, a, b, c, d, segmentsCount, errorBound, approximation)) {
 			return segmentsCount;
 		}
 	}
@@ -464,8 +609,30 @@ static int _cubic_to_quad(const CBezier *cb, double errorBound, QBezier approxim
 
 static int cubic_to_quad(const CBezier *cb, double errorBound, QBezier result[MAX_QUADS_OUT])
 {
+	double coefficients[3];
 	double inflections[MAX_INFLECTIONS];
-	int numInflections = solve_inflections(cb, inflections);
+	int numInflections;
+
+	switch (classify_cubic(cb, coefficients, &result[0])) {
+	case CUBIC_POINT:
+		COUNT(points);
+		return 1;
+	case CUBIC_LINE:
+		COUNT(lines);
+		return 1;
+	case CUBIC_QUAD:
+		COUNT(quads);
+		return 1;
+	case CUBIC_CUSP:
+		COUNT(cusps);
+		numInflections = 1;
+		inflections[0] = -coefficients[1] / (2*coefficients[0]);
+		break;
+	default:
+		COUNT(general);
+		numInflections = find_inflections(coefficients, inflections);
+		break;
+	}
 
 	if (numInflections == 0) {
 		return _cubic_to_quad(cb, errorBound, result);
@@ -496,11 +663,769 @@ static int cubic_to_quad(const CBezier *cb, double errorBound, QBezier result[MA
 // 24 quads * 3 points per quad * 2 doubles per point
 #define MAX_DOUBLES_OUT (MAX_QUADS_OUT * 3 * 2) // 144 (1152 bytes)
 
+/*
+ * Cut section `index` out of cubic curve split at the ascending parameters in splits, the same
+ * way cubic_to_quad() does, so that neighbouring sections share exactly the same end points.
+ */
+static void split_section(const CBezier *cb, const double *splits, const int nsplits, const int index, CBezier *out)
+{
+	CBezier curve = *cb;
+	double prevPoint = 0;
+
+	CBezier split[2];
+	for (int i = 0; i < nsplits && i <= index; i++) {
+		subdivide_cubic(&curve, 1 - (1 - splits[i]) / (1 - prevPoint), split);
+		if (i == index) {
+			*out = split[0];
+			return;
+		}
+		curve = split[1];
+		prevPoint = splits[i];
+	}
+	*out = curve;
+}
+
+static bool approximate_section(
+	const CBezier *cb, const double *splits, const int nsplits, const int index,
+	const int segmentsCount, const double errorBound, QBezier *approximation)
+{
+	CBezier section;
+	split_section(cb, splits, nsplits, index, &section);
+	Point pc[4];
+	calc_power_coefficients(section.p1, section.c1, section.c2, section.p2, pc);
+	return approximate_segments(&section, pc[0], pc[1], pc[2], pc[3], segmentsCount, errorBound, approximation);
+}
+
+// Converts the corresponding cubic of each master into point-compatible
+// quadratics for cubic2quad_compatible(). Every master is split at the same
+// parameters, the average of the inflections of the masters that have the
+// most of them, and each section gets the largest segment count any master
+// needs.
+static int compatible_to_quad(const double *in, const int masters, const double errorBound, double *out)
+{
+	if (masters < 1) {
+		return -1;
+	}
+
+	const CBezier *cubics = (const CBezier *)in;
+
+	double splits[MAX_INFLECTIONS] = { 0 };
+	int nsplits = 0, nmasters = 0;
+	for (int m = 0; m < masters; m++) {
+		double coefficients[3];
+		double inflections[MAX_INFLECTIONS];
+		calc_inflection_coefficients(&cubics[m], coefficients);
+		const int n = find_inflections(coefficients, inflections);
+		if (n > nsplits) {
+			nsplits = n;
+			nmasters = 0;
+			for (int i = 0; i < MAX_INFLECTIONS; i++) {
+				splits[i] = 0;
+			}
+		}
+		if (n == nsplits) {
+			for (int i = 0; i < n; i++) {
+				splits[i] += inflections[i];
+			}
+			nmasters++;
+		}
+	}
+	for (int i = 0; i < nsplits; i++) {
+		splits[i] /= nmasters;
+	}
+
+	int nq = 0;
+	for (int section = 0; section <= nsplits; section++) {
+		int segmentsCount = 1;
+		bool close = false;
+		for (; segmentsCount <= MAX_SEGMENTS && !close; segmentsCount++) {
+			close = true;
+			for (int m = 0; m < masters && close; m++) {
+				QBezier *approximation = &((QBezier *)&out[m * MAX_DOUBLES_OUT])[nq];
+				close = approximate_section(&cubics[m], splits, nsplits, section, segmentsCount, errorBound, approximation);
+			}
+		}
+		segmentsCount--;
+		if (!close) {
+			// gave up at MAX_SEGMENTS, and the masters after the first one that
+			// wasn't close were never approximated with it, so redo them all
+			for (int m = 0; m < masters; m++) {
+				QBezier *approximation = &((QBezier *)&out[m * MAX_DOUBLES_OUT])[nq];
+				approximate_section(&cubics[m], splits, nsplits, section, segmentsCount, errorBound, approximation);
+			}
+		}
+		nq += segmentsCount;
+	}
+	return nq;
+}
+
+// Limit for cubic2quad_unbounded(), so that an errorBound that floating point error makes
+// unreachable still terminates.
+#define MAX_UNBOUNDED_SEGMENTS (1 << 16)
+
+static bool approximate_many_segments(
+	const Point a, const Point b, const Point c, const Point d,
+	const int segmentsCount, const double errorBound, QBezier *approximation)
+{
+	// Same as approximate_segments() for more than MAX_SEGMENTS segments (so the convexity
+	// check doesn't apply), but checks each segment right away. If approximation is NULL the
+	// segments are only checked, so no room is needed for them.
+	for (int i = 0; i < segmentsCount; i++) {
+		const double t = (double)i/(double)segmentsCount;
+		const double t2 = (double)(i + 1)/(double)segmentsCount;
+		QBezier segment;
+		process_segment(a, b, c, d, t, t2, &segment);
+		if (approximation) {
+			approximation[i] = segment;
+		} else if (!is_segment_approximation_close(a, b, c, d, t, t2, segment.p1, segment.c1, segment.p2, errorBound)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static int count_unbounded_segments(const CBezier *cb, const double errorBound, bool *boundMet)
+{
+	Point pc[4];
+	calc_power_coefficients(cb->p1, cb->c1, cb->c2, cb->p2, pc);
+
+	// the same search as _cubic_to_quad() first, so the result is the same whenever that meets
+	// errorBound
+	QBezier approximation[MAX_SEGMENTS];
+	for (int segmentsCount = 1; segmentsCount <= MAX_SEGMENTS; segmentsCount++) {
+		if (approximate_segments(cb, pc[0], pc[1], pc[2], pc[3], segmentsCount, errorBound, approximation)) {
+			return segmentsCount;
+		}
+	}
+
+	// then double the count until close, and binary search back down for the smallest close one
+	int lo = MAX_SEGMENTS, hi = MAX_SEGMENTS * 2;
+	while (!approximate_many_segments(pc[0], pc[1], pc[2], pc[3], hi, errorBound, NULL)) {
+		if (hi >= MAX_UNBOUNDED_SEGMENTS) {
+			*boundMet = false;
+			return MAX_UNBOUNDED_SEGMENTS;
+		}
+		lo = hi;
+		hi *= 2;
+	}
+	while (hi - lo > 1) {
+		const int mid = lo + (hi - lo) / 2;
+		if (approximate_many_segments(pc[0], pc[1], pc[2], pc[3], mid, errorBound, NULL)) {
+			hi = mid;
+		} else {
+			lo = mid;
+		}
+	}
+	return hi;
+}
+
+// Converts the input cubic for cubic2quad_unbounded(), like cubic2quad() but without
+// MAX_SEGMENTS. The segment count of
+// each section is found first without storing any quadratics, so the output can be allocated
+// once at its final size.
+static int unbounded_to_quad(const double in[8], const double errorBound, const C2QAllocator *allocator,
+	double **out, bool *boundMet)
+{
+	const CBezier *cb = (const CBezier *)in;
+	bool met = true;
+
+	double coefficients[3];
+	double splits[MAX_INFLECTIONS];
+	int nsplits;
+	QBezier quad;
+	switch (classify_cubic(cb, coefficients, &quad)) {
+	case CUBIC_POINT:
+	case CUBIC_LINE:
+	case CUBIC_QUAD:
+	{
+		QBezier *result = allocator->alloc(allocator->ctx, sizeof(QBezier));
+		if (!result) {
+			return -1;
+		}
+		*result = quad;
+		*out = (double *)result;
+		if (boundMet) {
+			*boundMet = true;
+		}
+		return 1;
+	}
+	case CUBIC_CUSP:
+		nsplits = 1;
+		splits[0] = -coefficients[1] / (2*coefficients[0]);
+		break;
+	default:
+		nsplits = find_inflections(coefficients, splits);
+		break;
+	}
+
+	int counts[MAX_INFLECTIONS + 1];
+	int nq = 0;
+	for (int section = 0; section <= nsplits; section++) {
+		CBezier curve;
+		split_section(cb, splits, nsplits, section, &curve);
+		counts[section] = count_unbounded_segments(&curve, errorBound, &met);
+		nq += counts[section];
+	}
+
+	QBezier *result = allocator->alloc(allocator->ctx, nq * sizeof(QBezier));
+	if (!result) {
+		return -1;
+	}
+	for (int section = 0, i = 0; section <= nsplits; i += counts[section++]) {
+		CBezier curve;
+		split_section(cb, splits, nsplits, section, &curve);
+		Point pc[4];
+		calc_power_coefficients(curve.p1, curve.c1, curve.c2, curve.p2, pc);
+		if (counts[section] <= MAX_SEGMENTS) {
+			approximate_segments(&curve, pc[0], pc[1], pc[2], pc[3], counts[section], errorBound, &result[i]);
+		} else {
+			approximate_many_segments(pc[0], pc[1], pc[2], pc[3], counts[section], errorBound, &result[i]);
+		}
+	}
+
+	*out = (double *)result;
+	if (boundMet) {
+		*boundMet = met;
+	}
+	return nq;
+}
+
+#ifdef C2Q_KERNEL
+
+// Built as one instruction set variant of the conversion kernels (see the
+// makefile), with C2Q_KERNEL set to its name, so only the kernels themselves
+// are exported, suffixed with that name, for the dispatcher in the main build
+// to pick from.
+#define KERNEL_NAME(name) KERNEL_NAME_(name, C2Q_KERNEL)
+#define KERNEL_NAME_(name, isa) KERNEL_NAME__(name, isa)
+#define KERNEL_NAME__(name, isa) c2q_##name##_##isa
+
+int KERNEL_NAME(kernel)(const double in[8], const double errorBound, double out[MAX_DOUBLES_OUT])
+{
+	return cubic_to_quad((const CBezier *)in, errorBound, (QBezier *)out);
+}
+
+int KERNEL_NAME(kernel_compatible)(const double *in, const int masters, const double errorBound, double *out)
+{
+	return compatible_to_quad(in, masters, errorBound, out);
+}
+
+int KERNEL_NAME(kernel_unbounded)(const double in[8], const double errorBound, const C2QAllocator *allocator,
+	double **out, bool *boundMet)
+{
+	return unbounded_to_quad(in, errorBound, allocator, out, boundMet);
+}
+
+#else // C2Q_KERNEL
+
+#ifdef C2Q_DISPATCH
+
+typedef struct {
+	int (*convert)(const double in[8], const double errorBound, double out[MAX_DOUBLES_OUT]);
+	int (*compatible)(const double *in, const int masters, const double errorBound, double *out);
+	int (*unbounded)(const double in[8], const double errorBound, const C2QAllocator *allocator,
+		double **out, bool *boundMet);
+} Kernels;
+
+static int c2q_kernel_scalar(const double in[8], const double errorBound, double out[MAX_DOUBLES_OUT])
+{
+	return cubic_to_quad((const CBezier *)in, errorBound, (QBezier *)out);
+}
+
+static const Kernels scalarKernels = { c2q_kernel_scalar, compatible_to_quad, unbounded_to_quad };
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS
+#define DECLARE_KERNELS(isa) \
+	int c2q_kernel_##isa(const double in[8], const double errorBound, double out[MAX_DOUBLES_OUT]); \
+	int c2q_kernel_compatible_##isa(const double *in, const int masters, const double errorBound, double *out); \
+	int c2q_kernel_unbounded_##isa(const double in[8], const double errorBound, const C2QAllocator *allocator, \
+		double **out, bool *boundMet); \
+	static const Kernels isa##Kernels = { c2q_kernel_##isa, c2q_kernel_compatible_##isa, c2q_kernel_unbounded_##isa };
+DECLARE_KERNELS(sse2)
+DECLARE_KERNELS(avx2)
+DECLARE_KERNELS(avx512)
+#endif
+
+static const Kernels *kernels = &scalarKernels;
+static int kernelIsa = C2Q_ISA_SCALAR;
+
+static bool isa_supported(const int isa)
+{
+	switch (isa) {
+	case C2Q_ISA_SCALAR:
+		return true;
+#ifdef HAVE_X86_KERNELS
+	case C2Q_ISA_SSE2:
+		return __builtin_cpu_supports("sse2");
+	case C2Q_ISA_AVX2:
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	case C2Q_ISA_AVX512:
+		return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("fma");
+#endif
+	default:
+		return false;
+	}
+}
+
+int c2q_set_isa(int isa)
+{
+	__builtin_cpu_init();
+	if (isa == C2Q_ISA_AUTO) {
+		// C2Q_ISA_SCALAR is always supported, so this terminates
+		for (isa = C2Q_ISA_AVX512; !isa_supported(isa); isa--);
+	} else if (!isa_supported(isa)) {
+		return -1;
+	}
+
+	switch (isa) {
+#ifdef HAVE_X86_KERNELS
+	case C2Q_ISA_SSE2: kernels = &sse2Kernels; break;
+	case C2Q_ISA_AVX2: kernels = &avx2Kernels; break;
+	case C2Q_ISA_AVX512: kernels = &avx512Kernels; break;
+#endif
+	default: kernels = &scalarKernels; break;
+	}
+	kernelIsa = isa;
+	return isa;
+}
+
+int c2q_get_isa(void)
+{
+	return kernelIsa;
+}
+
+// Picks the kernel when the library is loaded. The C2Q_ISA environment
+// variable (scalar, sse2, avx2 or avx512) forces a specific one, falling back
+// to the best supported one if the host CPU can't run it.
+__attribute__((constructor))
+static void init_kernel(void)
+{
+	static const char * const names[] = { "auto", "scalar", "sse2", "avx2", "avx512" };
+	const char *force = getenv("C2Q_ISA");
+	int isa = C2Q_ISA_AUTO;
+	for (int i = 0; force && i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+		if (strcmp(force, names[i]) == 0) {
+			isa = i;
+		}
+	}
+	if (c2q_set_isa(isa) < 0) {
+		c2q_set_isa(C2Q_ISA_AUTO);
+	}
+}
+
+static int convert(const CBezier *cb, const double errorBound, QBezier out[MAX_QUADS_OUT])
+{
+	return kernels->convert((const double *)cb, errorBound, (double *)out);
+}
+
+static int compatible(const double *in, const int masters, const double errorBound, double *out)
+{
+	return kernels->compatible(in, masters, errorBound, out);
+}
+
+static int unbounded(const double in[8], const double errorBound, const C2QAllocator *allocator,
+	double **out, bool *boundMet)
+{
+	return kernels->unbounded(in, errorBound, allocator, out, boundMet);
+}
+
+#else // C2Q_DISPATCH
+
+static int convert(const CBezier *cb, const double errorBound, QBezier out[MAX_QUADS_OUT])
+{
+	return cubic_to_quad(cb, errorBound, out);
+}
+
+static int compatible(const double *in, const int masters, const double errorBound, double *out)
+{
+	return compatible_to_quad(in, masters, errorBound, out);
+}
+
+static int unbounded(const double in[8], const double errorBound, const C2QAllocator *allocator,
+	double **out, bool *boundMet)
+{
+	return unbounded_to_quad(in, errorBound, allocator, out, boundMet);
+}
+
+#endif // C2Q_DISPATCH
+
+static Point p_transform(const Point a, const double m[6])
+{
+	// x' = m0*x + m2*y + m4
+	// y' = m1*x + m3*y + m5
+	return p_new(m[0]*a.x + m[2]*a.y + m[4], m[1]*a.x + m[3]*a.y + m[5]);
+}
+
 // Converts the input cubic
 // (8 doubles in p1x, p1y, c1x, c1y, c2x, c2y, p2x, p2y form)
 // into up to 24 quadratics. The output buffer must be at least 144 doubles
 // long for the 24 quadratics (6 bytes each).
 int cubic2quad(const double in[8], const double errorBound, double out[MAX_DOUBLES_OUT])
 {
-	return cubic_to_quad((const CBezier *)in, errorBound, (QBezier *)out);
+	return convert((const CBezier *)in, errorBound, (QBezier *)out);
+}
+
+// Converts the input cubic after mapping it through the 2x3 affine matrix
+// (a, b, c, d, e, f). Bezier curves are affine invariant, so transforming the
+// four control points is the same as transforming the whole curve, and the
+// errorBound check then happens entirely in the transformed space.
+int cubic2quad_transformed(const double in[8], const double matrix[6], const double errorBound, double out[MAX_DOUBLES_OUT])
+{
+	const CBezier *cb = (const CBezier *)in;
+	CBezier transformed;
+	transformed.p1 = p_transform(cb->p1, matrix);
+	transformed.c1 = p_transform(cb->c1, matrix);
+	transformed.c2 = p_transform(cb->c2, matrix);
+	transformed.p2 = p_transform(cb->p2, matrix);
+	return convert(&transformed, errorBound, (QBezier *)out);
+}
+
+void c2q_path_init(C2QPath *path, C2QPathCubic *cubics, int length, const double *in, const double precision)
+{
+	path->cubics = cubics;
+	path->length = length;
+	path->precision = precision;
+	for (int i = 0; i < length; i++) {
+		memcpy(cubics[i].in, &in[i * 8], sizeof(cubics[i].in));
+		cubics[i].count = 0;
+		cubics[i].dirty = true;
+	}
+}
+
+void c2q_path_set(C2QPath *path, int index, const double in[8])
+{
+	C2QPathCubic *cubic = &path->cubics[index];
+	for (int i = 0; i < 8; i++) {
+		if (cubic->in[i] != in[i]) {
+			memcpy(cubic->in, in, sizeof(cubic->in));
+			cubic->dirty = true;
+			return;
+		}
+	}
+}
+
+int c2q_path_update(C2QPath *path, int *changed)
+{
+	int nchanged = 0;
+	for (int i = 0; i < path->length; i++) {
+		C2QPathCubic *cubic = &path->cubics[i];
+		if (!cubic->dirty) {
+			continue;
+		}
+		cubic->count = cubic2quad(cubic->in, path->precision, cubic->out);
+		cubic->dirty = false;
+		if (changed) {
+			changed[nchanged] = i;
+		}
+		nchanged++;
+	}
+	return nchanged;
+}
+
+int cubic2quad_compatible(const double *in, const int masters, const double errorBound, double *out)
+{
+	return compatible(in, masters, errorBound, out);
+}
+
+static bool put_varint(C2QEncoder *enc, size_t *len, const int64_t value)
+{
+	// zigzag encoding maps small negative values to small positive ones
+	uint64_t u = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+	do {
+		if (*len >= enc->cap) {
+			return false;
+		}
+		enc->buf[(*len)++] = (unsigned char)((u & 0x7f) | (u > 0x7f ? 0x80 : 0));
+		u >>= 7;
+	} while (u);
+	return true;
+}
+
+// Points are limited to this many multiples of the grid, so that the difference between two of
+// them always fits in an int64_t.
+#define MAX_STREAM_COORDINATE (INT64_C(1) << 61)
+
+static bool put_point(C2QEncoder *enc, size_t *len, int64_t *x, int64_t *y, const double px, const double py)
+{
+	// written so that NaN fails too
+	const double gx = px / enc->grid, gy = py / enc->grid;
+	if (!(fabs(gx) < MAX_STREAM_COORDINATE && fabs(gy) < MAX_STREAM_COORDINATE)) {
+		return false;
+	}
+	const int64_t qx = llround(gx);
+	const int64_t qy = llround(gy);
+	if (!put_varint(enc, len, qx - *x) || !put_varint(enc, len, qy - *y)) {
+		return false;
+	}
+	*x = qx;
+	*y = qy;
+	return true;
+}
+
+void c2q_encoder_init(C2QEncoder *enc, unsigned char *buf, size_t cap, const double grid)
+{
+	enc->buf = buf;
+	enc->cap = cap;
+	enc->len = 0;
+	enc->grid = grid;
+	enc->x = 0;
+	enc->y = 0;
+}
+
+// Each spline is stored as its quadratic count followed by its first point
+// and then the control and end point of each quadratic, each point being the
+// difference from the one before it.
+int c2q_encode(C2QEncoder *enc, const double *quads, const int count)
+{
+	if (count < 1 || count > MAX_QUADS_OUT || !(enc->grid > 0 && isfinite(enc->grid))) {
+		return -1;
+	}
+
+	// work on copies so that nothing changes if buf runs out or a point can't be encoded
+	size_t len = enc->len;
+	int64_t x = enc->x, y = enc->y;
+	if (!put_varint(enc, &len, count) || !put_point(enc, &len, &x, &y, quads[0], quads[1])) {
+		return -1;
+	}
+	for (int i = 0; i < count; i++) {
+		const double *q = &quads[i * 6];
+		if (!put_point(enc, &len, &x, &y, q[2], q[3]) || !put_point(enc, &len, &x, &y, q[4], q[5])) {
+			return -1;
+		}
+	}
+
+	enc->len = len;
+	enc->x = x;
+	enc->y = y;
+	return 0;
+}
+
+int cubic2quad_encode(const double in[8], const double errorBound, C2QEncoder *enc)
+{
+	double out[MAX_DOUBLES_OUT];
+	const int count = cubic2quad(in, errorBound, out);
+	return c2q_encode(enc, out, count) == 0 ? count : -1;
+}
+
+static int get_varint(const C2QDecoder *dec, size_t *pos, int64_t *value)
+{
+	uint64_t u = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (*pos >= dec->len) {
+			return C2Q_DECODE_INCOMPLETE;
+		}
+		const unsigned char byte = dec->buf[(*pos)++];
+		if (shift == 63 && byte > 1) {
+			return C2Q_DECODE_MALFORMED; // more than 64 bits
+		}
+		u |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			*value = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+			return 0;
+		}
+	}
+	return C2Q_DECODE_MALFORMED; // more than 64 bits
+}
+
+static int get_coordinate(const C2QDecoder *dec, size_t *pos, int64_t *value)
+{
+	int64_t delta;
+	const int result = get_varint(dec, pos, &delta);
+	if (result < 0) {
+		return result;
+	}
+	// checked before adding so a bad delta can't overflow
+	if (delta <= -2 * MAX_STREAM_COORDINATE || delta >= 2 * MAX_STREAM_COORDINATE) {
+		return C2Q_DECODE_MALFORMED;
+	}
+	*value += delta;
+	if (*value <= -MAX_STREAM_COORDINATE || *value >= MAX_STREAM_COORDINATE) {
+		return C2Q_DECODE_MALFORMED;
+	}
+	return 0;
+}
+
+static int get_point(const C2QDecoder *dec, size_t *pos, int64_t *x, int64_t *y, double *out)
+{
+	int result = get_coordinate(dec, pos, x);
+	if (result == 0) {
+		result = get_coordinate(dec, pos, y);
+	}
+	out[0] = *x * dec->grid;
+	out[1] = *y * dec->grid;
+	return result;
+}
+
+void c2q_decoder_init(C2QDecoder *dec, const unsigned char *buf, size_t len, const double grid)
+{
+	dec->buf = buf;
+	dec->len = len;
+	dec->pos = 0;
+	dec->grid = grid;
+	dec->x = 0;
+	dec->y = 0;
+}
+
+int c2q_decode(C2QDecoder *dec, double out[MAX_DOUBLES_OUT])
+{
+	if (dec->pos >= dec->len) {
+		return 0;
+	}
+
+	// work on copies so that nothing is consumed if the spline is incomplete
+	size_t pos = dec->pos;
+	int64_t x = dec->x, y = dec->y;
+	int64_t count;
+	int result = get_varint(dec, &pos, &count);
+	if (result < 0) {
+		return result;
+	}
+	if (count < 1 || count > MAX_QUADS_OUT) {
+		return C2Q_DECODE_MALFORMED;
+	}
+	result = get_point(dec, &pos, &x, &y, &out[0]);
+	for (int i = 0; i < count && result == 0; i++) {
+		double *q = &out[i * 6];
+		if (i > 0) {
+			q[0] = q[-2];
+			q[1] = q[-1];
+		}
+		result = get_point(dec, &pos, &x, &y, &q[2]);
+		if (result == 0) {
+			result = get_point(dec, &pos, &x, &y, &q[4]);
+		}
+	}
+	if (result < 0) {
+		return result;
+	}
+
+	dec->pos = pos;
+	dec->x = x;
+	dec->y = y;
+	return (int)count;
+}
+
+#ifdef C2Q_STATS
+
+void c2q_get_stats(C2QStats *stats)
+{
+	*stats = c2q_stats;
+}
+
+void c2q_reset_stats(void)
+{
+	memset(&c2q_stats, 0, sizeof(c2q_stats));
+}
+
+#endif // C2Q_STATS
+
+static void quad_extent(const double p1, const double c1, const double p2, double *min, double *max)
+{
+	// f(t) = (1-t)^2 * p1 + 2*t*(1 - t) * c1 + t^2 * p2 has its extremum where
+	// f'(t) = 2*((p1 - 2*c1 + p2)*t - (p1 - c1)) = 0, which only matters if it is within (0, 1)
+	*min = fmin(p1, p2);
+	*max = fmax(p1, p2);
+	const double denom = p1 - 2*c1 + p2;
+	if (denom == 0) {
+		return;
+	}
+	const double t = (p1 - c1) / denom;
+	if (t > 0 && t < 1) {
+		const double value = (1-t)*(1-t)*p1 + 2*t*(1-t)*c1 + t*t*p2;
+		*min = fmin(*min, value);
+		*max = fmax(*max, value);
+	}
+}
+
+static void quad_bounds(const QBezier *quad, double out[4])
+{
+	quad_extent(quad->p1.x, quad->c1.x, quad->p2.x, &out[0], &out[2]);
+	quad_extent(quad->p1.y, quad->c1.y, quad->p2.y, &out[1], &out[3]);
 }
+
+void c2q_tile_grid_init(C2QTileGrid *grid, double x, double y, double tileWidth, double tileHeight,
+	int columns, int rows, int *tiles, int *counts, int capacity)
+{
+	grid->x = x;
+	grid->y = y;
+	grid->tileWidth = tileWidth;
+	grid->tileHeight = tileHeight;
+	grid->columns = columns;
+	grid->rows = rows;
+	grid->tiles = tiles;
+	grid->counts = counts;
+	grid->capacity = capacity;
+	grid->quadCount = 0;
+	memset(counts, 0, columns * rows * sizeof(int));
+}
+
+static void bin_quad(C2QTileGrid *grid, const double bounds[4], const int index)
+{
+	// range of tiles overlapped, clamped to the grid
+	const double col0 = floor((bounds[0] - grid->x) / grid->tileWidth);
+	const double row0 = floor((bounds[1] - grid->y) / grid->tileHeight);
+	const double col1 = floor((bounds[2] - grid->x) / grid->tileWidth);
+	const double row1 = floor((bounds[3] - grid->y) / grid->tileHeight);
+	if (col1 < 0 || row1 < 0 || col0 >= grid->columns || row0 >= grid->rows) {
+		return;
+	}
+	const int firstCol = col0 < 0 ? 0 : (int)col0;
+	const int firstRow = row0 < 0 ? 0 : (int)row0;
+	const int lastCol = col1 >= grid->columns ? grid->columns - 1 : (int)col1;
+	const int lastRow = row1 >= grid->rows ? grid->rows - 1 : (int)row1;
+
+	for (int row = firstRow; row <= lastRow; row++) {
+		for (int col = firstCol; col <= lastCol; col++) {
+			const int tile = row * grid->columns + col;
+			if (grid->counts[tile] < grid->capacity) {
+				grid->tiles[tile * grid->capacity + grid->counts[tile]] = index;
+			}
+			grid->counts[tile]++;
+		}
+	}
+}
+
+int cubic2quad_binned(const double in[8], const double errorBound, double out[MAX_DOUBLES_OUT],
+	double bounds[MAX_QUADS_OUT * 4], C2QTileGrid *grid)
+{
+	const int n = cubic2quad(in, errorBound, out);
+	const QBezier *quads = (const QBezier *)out;
+	for (int i = 0; i < n; i++) {
+		double quadBounds[4];
+		quad_bounds(&quads[i], quadBounds);
+		if (bounds) {
+			memcpy(&bounds[i * 4], quadBounds, sizeof(quadBounds));
+		}
+		bin_quad(grid, quadBounds, grid->quadCount++);
+	}
+	return n;
+}
+
+void c2q_arena_init(C2QArena *arena, unsigned char *buf, size_t cap)
+{
+	arena->buf = buf;
+	arena->cap = cap;
+	arena->len = 0;
+}
+
+void *c2q_arena_alloc(void *ctx, size_t size)
+{
+	C2QArena *arena = ctx;
+	const uintptr_t misalignment = (uintptr_t)(arena->buf + arena->len) % sizeof(double);
+	const size_t padding = misalignment ? sizeof(double) - misalignment : 0;
+	if (arena->cap - arena->len < padding || arena->cap - arena->len - padding < size) {
+		return NULL;
+	}
+	void *p = arena->buf + arena->len + padding;
+	arena->len += padding + size;
+	return p;
+}
+
+int cubic2quad_unbounded(const double in[8], const double errorBound, const C2QAllocator *allocator,
+	double **out, bool *boundMet)
+{
+	return unbounded(in, errorBound, allocator, out, boundMet);
+}
+
+#endif // C2Q_KERNEL
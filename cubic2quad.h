@@ -1,6 +1,10 @@
 #ifndef _H_CUBIC2QUAD
 #define _H_CUBIC2QUAD
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 // Minimum size of the cubic2quad() output buffer, in number of doubles.
 #define C2Q_OUT_LEN 144
 
@@ -28,4 +32,302 @@
 //     the buffer (total of C2Q_OUT_LEN doubles long) is undefined.
 int cubic2quad(const double in[8], const double precision, double out[C2Q_OUT_LEN]);
 
+// cubic2quad_transformed is the same as cubic2quad, but first maps the input
+// cubic through an affine transform. The output quadratics are in transformed
+// space and `precision` is measured there too, so there is no need to
+// pre-scale it for zoom or non-uniform scaling.
+//
+// Parameters:
+// in: The input cubic bezier, as in cubic2quad.
+//
+// matrix: A 2x3 affine matrix in the form
+//     a, b, c, d, e, f
+//     which maps each point (x, y) to (a*x + c*y + e, b*x + d*y + f), the
+//     same layout as SVG's matrix() transform.
+//
+// precision, out, return value: Same as cubic2quad.
+int cubic2quad_transformed(const double in[8], const double matrix[6], const double precision, double out[C2Q_OUT_LEN]);
+
+// cubic2quad_compatible converts the corresponding cubic of each master of a
+// variable font (or any set of curves that will be interpolated) into
+// quadratics that are point-compatible: every master gets the same number of
+// quadratics, split at the same parameters along the cubic, so instances can
+// be interpolated between the outputs. Each master's output approximates its
+// own cubic the same way cubic2quad does, with the same limit on the number
+// of quadratics, so it may likewise not be within `precision` of the cubic.
+// This is more likely than with cubic2quad when the masters' inflections are
+// far apart, as all masters are split at their average.
+//
+// Parameters:
+// in: The input cubics, 8 doubles per master in the same form as cubic2quad,
+//     one after the other.
+//
+// masters: The number of masters in `in`.
+//
+// precision: Same as cubic2quad.
+//
+// out: The output quadratics, in the same form as cubic2quad. Master `m` is
+//     written starting at out[m * C2Q_OUT_LEN], so the buffer must be at
+//     least (masters*C2Q_OUT_LEN*sizeof(double)) bytes long.
+//
+// Return value: The number of output quadratics written for each master, or
+//     -1 if `masters` is less than 1.
+int cubic2quad_compatible(const double *in, const int masters, const double precision, double *out);
+
+// C2QEncoder writes quadratic splines, as output by cubic2quad, into a
+// compact binary stream. Each point is rounded to a multiple of `grid`, then
+// stored as the zigzag varint encoded difference from the previous point in
+// the stream, so consecutive quadratics and splines sharing end points cost
+// only a few bytes per point. The fields may be read directly, but should
+// only be changed through the c2q_encode* functions.
+typedef struct {
+	unsigned char *buf; // Output buffer
+	size_t cap;         // Size of `buf`
+	size_t len;         // Number of bytes written to `buf`
+	double grid;
+	int64_t x, y;       // Last point written, in multiples of `grid`
+} C2QEncoder;
+
+// c2q_encoder_init sets up `enc` to write to the caller-allocated `buf` of
+// `cap` bytes, with points rounded to multiples of `grid`. Note that the
+// rounding adds up to grid/sqrt(2) to the error of each point.
+void c2q_encoder_init(C2QEncoder *enc, unsigned char *buf, size_t cap, const double grid);
+
+// c2q_encode appends a spline of `count` quadratics, in the same form as the
+// output of cubic2quad, to the stream.
+//
+// Return value: 0 on success, or -1 if `count` is more than fits in a
+// cubic2quad output buffer, `buf` is too small, `grid` is not a positive
+// finite number, or a point is not finite or further than about 2^61 grid
+// steps from the origin, in which case nothing is written.
+int c2q_encode(C2QEncoder *enc, const double *quads, const int count);
+
+// cubic2quad_encode converts the input cubic as in cubic2quad and appends
+// the output quadratics to the stream.
+//
+// Return value: The number of quadratics written, or -1 if c2q_encode
+// fails, in which case nothing is written.
+int cubic2quad_encode(const double in[8], const double precision, C2QEncoder *enc);
+
+// Error return values of c2q_decode.
+#define C2Q_DECODE_INCOMPLETE (-1)
+#define C2Q_DECODE_MALFORMED (-2)
+
+// C2QDecoder reads back the splines written by a C2QEncoder, one at a time.
+typedef struct {
+	const unsigned char *buf; // Input buffer
+	size_t len;               // Size of `buf`
+	size_t pos;               // Number of bytes of `buf` read so far
+	double grid;
+	int64_t x, y;             // Last point read, in multiples of `grid`
+} C2QDecoder;
+
+// c2q_decoder_init sets up `dec` to read from `buf` of `len` bytes. `grid`
+// must be the same as the one the stream was encoded with.
+void c2q_decoder_init(C2QDecoder *dec, const unsigned char *buf, size_t len, const double grid);
+
+// c2q_decode reads the next spline from the stream into `out`, in the same
+// form as the output of cubic2quad.
+//
+// Return value: The number of quadratics read, 0 at the end of the stream,
+// C2Q_DECODE_INCOMPLETE if the stream ends in the middle of a spline, or
+// C2Q_DECODE_MALFORMED if the stream wasn't written by a C2QEncoder with
+// the same `grid`. On either error nothing is consumed. After
+// C2Q_DECODE_INCOMPLETE, if the stream is still being received, `buf` and
+// `len` may be updated to cover more of it and c2q_decode called again.
+int c2q_decode(C2QDecoder *dec, double out[C2Q_OUT_LEN]);
+
+// Minimum size of the cubic2quad_binned() bounds buffer, in number of doubles.
+#define C2Q_BOUNDS_LEN 96
+
+// C2QTileGrid bins quadratics into the tiles of a grid that they overlap,
+// for rasterizers that process one tile at a time. All arrays are allocated
+// by the caller. The fields may be read directly, but should only be changed
+// through the c2q_tile_grid_init and cubic2quad_binned functions.
+typedef struct {
+	double x, y;           // Position of the top left corner of the grid
+	double tileWidth;
+	double tileHeight;
+	int columns;
+	int rows;
+	int *tiles;            // For each tile, row by row, a list of `capacity`
+	                       // quadratic indices
+	int *counts;           // For each tile, the number of quadratics that
+	                       // overlap it. If more than `capacity`, only the
+	                       // first `capacity` are in its list.
+	int capacity;
+	int quadCount;         // Number of quadratics binned so far. Quadratics
+	                       // are numbered in the order they are binned.
+} C2QTileGrid;
+
+// c2q_tile_grid_init sets up `grid` with `columns` by `rows` tiles, each
+// `tileWidth` by `tileHeight` large, with its top left corner at (x, y).
+// `tiles` must have room for (columns*rows*capacity) ints and `counts` for
+// (columns*rows) ints.
+void c2q_tile_grid_init(C2QTileGrid *grid, double x, double y, double tileWidth, double tileHeight,
+	int columns, int rows, int *tiles, int *counts, int capacity);
+
+// cubic2quad_binned converts the input cubic as in cubic2quad, then computes
+// the tight bounding box of each output quadratic and appends its index to
+// the list of every tile in `grid` that the box overlaps.
+//
+// Parameters:
+// in, precision, out: Same as cubic2quad.
+//
+// bounds: If not NULL, receives the bounding box of each output quadratic,
+//     each a repetition of 4 doubles
+//     minx, miny, maxx, maxy
+//     The buffer must be at least (C2Q_BOUNDS_LEN*sizeof(double)) bytes long.
+//
+// grid: The tile grid to bin the output quadratics into.
+//
+// Return value: Same as cubic2quad.
+int cubic2quad_binned(const double in[8], const double precision, double out[C2Q_OUT_LEN],
+	double bounds[C2Q_BOUNDS_LEN], C2QTileGrid *grid);
+
+// C2QAllocator lets the caller decide where cubic2quad_unbounded puts its
+// output. `alloc` is called with `ctx` and a size in bytes, and returns
+// memory suitably aligned for doubles, or NULL if it cannot.
+typedef struct {
+	void *(*alloc)(void *ctx, size_t size);
+	void *ctx;
+} C2QAllocator;
+
+// C2QArena is a simple bump allocator over a caller-allocated buffer, for
+// use as a C2QAllocator with c2q_arena_alloc as `alloc` and the arena as
+// `ctx`. Everything allocated from it is freed at once by setting `len` back
+// to 0.
+typedef struct {
+	unsigned char *buf;
+	size_t cap;         // Size of `buf`
+	size_t len;         // Number of bytes of `buf` used so far
+} C2QArena;
+
+// c2q_arena_init sets up `arena` to allocate from `buf` of `cap` bytes.
+void c2q_arena_init(C2QArena *arena, unsigned char *buf, size_t cap);
+
+// c2q_arena_alloc allocates `size` bytes from the C2QArena `arena`, aligned
+// for doubles, or returns NULL if it is full.
+void *c2q_arena_alloc(void *arena, size_t size);
+
+// cubic2quad_unbounded is the same as cubic2quad, but without the limit of 8
+// quadratics per section between inflections, so the output is within
+// `precision` of the cubic even at large coordinate scales, where cubic2quad
+// may give up before reaching it. The output is allocated from `allocator`
+// once its length is known.
+//
+// Parameters:
+// in, precision: Same as cubic2quad.
+//
+// allocator: Where to allocate the output buffer from.
+//
+// out: Receives the output buffer, with the output quadratics in the same
+//     form as the output of cubic2quad.
+//
+// boundMet: If not NULL, receives whether the output is within
+//     `precision` of the cubic. This is only false when `precision` is too
+//     small to reach with up to 65536 quadratics per section, e.g. because
+//     of floating point error.
+//
+// Return value: The number of output quadratics in `out`, or -1 if the
+//     allocation failed, in which case `out` is not set.
+int cubic2quad_unbounded(const double in[8], const double precision, const C2QAllocator *allocator,
+	double **out, bool *boundMet);
+
+// One cubic of a C2QPath along with its converted quadratics. The fields may
+// be read directly, but should only be changed through the c2q_path_*
+// functions.
+typedef struct {
+	double in[8];            // The input cubic, as in cubic2quad
+	double out[C2Q_OUT_LEN]; // The output quadratics, as in cubic2quad
+	int count;               // Number of quadratics in `out`
+	bool dirty;              // `in` changed since `out` was last converted
+} C2QPathCubic;
+
+// C2QPath keeps the cubics of a path together with their converted
+// quadratics so that, when only a few cubics change (e.g. while dragging a
+// point in an editor), only those are converted again.
+typedef struct {
+	C2QPathCubic *cubics;
+	int length;
+	double precision;
+} C2QPath;
+
+// c2q_path_init sets up `path` to use the caller-allocated `cubics` array of
+// `length` entries, copies `length` input cubics (8 doubles each) from `in`
+// into it and marks all of them dirty. No conversion happens until
+// c2q_path_update is called.
+void c2q_path_init(C2QPath *path, C2QPathCubic *cubics, int length, const double *in, const double precision);
+
+// c2q_path_set replaces the cubic at `index` and marks it dirty if it is
+// different from the previous one. Note that moving an on-curve point of a
+// path changes two cubics, which must both be set.
+void c2q_path_set(C2QPath *path, int index, const double in[8]);
+
+// c2q_path_update converts every dirty cubic of `path` and clears its dirty
+// flag.
+//
+// Parameters:
+// changed: If not NULL, receives the indices of the converted cubics in
+//     ascending order. Must have room for `path->length` ints.
+//
+// Return value: The number of cubics that were converted.
+int c2q_path_update(C2QPath *path, int *changed);
+
+// Counts of each kind of input cubic converted so far, and of the distance
+// measurements made checking the error of the output. Points, lines (all
+// control points on the segment between the end points) and exact degree
+// elevated quadratics are converted to a single quadratic right away, and
+// cusps skip solving for inflections.
+typedef struct {
+	unsigned long points;
+	unsigned long lines;
+	unsigned long quads;
+	unsigned long cusps;
+	unsigned long general; // Everything else
+	unsigned long distanceChecks; // Points of the cubic whose distance to an
+	                              // output quadratic was measured, by any
+	                              // conversion function
+} C2QStats;
+
+// c2q_get_stats copies the counts of each kind of input cubic converted
+// since the start of the program or the last c2q_reset_stats into `stats`.
+// cubic2quad_compatible and cubic2quad_unbounded are not counted.
+//
+// These functions are only available when cubic2quad.c is built with
+// C2Q_STATS defined. The counters are global and not updated atomically, so
+// they are approximate when converting from multiple threads.
+void c2q_get_stats(C2QStats *stats);
+
+// c2q_reset_stats sets all counts to zero.
+void c2q_reset_stats(void);
+
+// Instruction set levels of the conversion kernel, for c2q_set_isa.
+enum {
+	C2Q_ISA_AUTO = 0, // Best level supported by the host CPU
+	C2Q_ISA_SCALAR,   // Built with only the compiler's baseline flags
+	C2Q_ISA_SSE2,
+	C2Q_ISA_AVX2,     // AVX2 + FMA
+	C2Q_ISA_AVX512,   // AVX-512F + FMA
+};
+
+// When built as a library (`make lib`), the conversion kernels behind
+// cubic2quad, cubic2quad_compatible and cubic2quad_unbounded (and the
+// functions built on them) are compiled once per instruction set level and the best one supported by the host CPU
+// is selected when the library is loaded. The C2Q_ISA environment variable
+// (scalar, sse2, avx2 or avx512) can override that choice at load time, and
+// c2q_set_isa can override it at runtime, e.g. for testing or benchmarking.
+// Levels above C2Q_ISA_SCALAR are only available on x86. Results may differ
+// between levels in the last bits, since FMA rounds differently.
+//
+// These functions are not available when cubic2quad.c is copied directly
+// into a project.
+//
+// c2q_set_isa returns the selected level, or -1 if `isa` is not supported
+// by the host CPU, in which case the current level is kept.
+int c2q_set_isa(int isa);
+
+// c2q_get_isa returns the currently selected level.
+int c2q_get_isa(void);
+
 #endif // _H_CUBIC2QUAD
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "cubic2quad.h"
+
+// Tests of the library build (see `make lib`), linked against
+// libcubic2quad.a rather than including cubic2quad.c like tests.c, so that
+// the instruction set dispatch is built in.
+
+#define assertTrue(a) do { \
+	if (!(a)) { \
+		fprintf(stderr, "assertion failed (value: %d). line %d\n", (bool)(a), __LINE__); \
+	} \
+} while(0)
+
+#define assertEqual(a, b) do { \
+	if ((a) != (b)) { \
+		fprintf(stderr, "assertion failed: %llu != %llu. line %d\n", (unsigned long long)(a), (unsigned long long)(b), __LINE__); \
+	} \
+} while(0)
+
+#define assertArraysCloseRes(a, b, n, res) do { \
+	for (int i = 0; i < n; i++) { \
+		if (fabs((a)[i] - (b)[i]) > (res)) { \
+			fprintf(stderr, "assertion failed: %f not close to %f (index %d). line %d\n", (a)[i], (b)[i], (i), __LINE__); \
+		} \
+	} \
+} while(0)
+
+#define NUM_CUBICS 200
+
+// Deterministic pseudo-random coordinates in [-50, 50)
+static double next_coordinate(unsigned int *state)
+{
+	*state = *state * 1103515245 + 12345;
+	return ((*state >> 8) & 0xffff) / 65536.0 * 100 - 50;
+}
+
+static void test_initial_isa()
+{
+	// the level picked at load time is the one C2Q_ISA asks for, or the best
+	// supported one
+	const int initial = c2q_get_isa();
+	const char *force = getenv("C2Q_ISA");
+	if (force && strcmp(force, "scalar") == 0) {
+		assertEqual(initial, C2Q_ISA_SCALAR);
+	} else if (!force) {
+		assertEqual(c2q_set_isa(C2Q_ISA_AUTO), initial);
+	}
+}
+
+static void test_set_isa()
+{
+	const int initial = c2q_get_isa();
+
+	// unsupported levels are rejected and the current one is kept
+	assertEqual(c2q_set_isa(C2Q_ISA_AVX512 + 1), -1);
+	assertEqual(c2q_get_isa(), initial);
+
+	// the scalar level is always supported
+	assertEqual(c2q_set_isa(C2Q_ISA_SCALAR), C2Q_ISA_SCALAR);
+	assertEqual(c2q_get_isa(), C2Q_ISA_SCALAR);
+
+	c2q_set_isa(initial);
+}
+
+static void test_isa_outputs()
+{
+	static double in[NUM_CUBICS * 8];
+	static double expect[NUM_CUBICS][C2Q_OUT_LEN];
+	static int nexpect[NUM_CUBICS];
+	double out[C2Q_OUT_LEN];
+	const int initial = c2q_get_isa();
+
+	unsigned int state = 1;
+	for (int j = 0; j < NUM_CUBICS * 8; j++) {
+		in[j] = next_coordinate(&state);
+	}
+
+	assertEqual(c2q_set_isa(C2Q_ISA_SCALAR), C2Q_ISA_SCALAR);
+	for (int j = 0; j < NUM_CUBICS; j++) {
+		nexpect[j] = cubic2quad(&in[j * 8], 0.1, expect[j]);
+	}
+
+	// every supported level gives the same output as the scalar one, apart
+	// from the different rounding of FMA
+	for (int isa = C2Q_ISA_SSE2; isa <= C2Q_ISA_AVX512; isa++) {
+		if (c2q_set_isa(isa) < 0) {
+			continue;
+		}
+		assertEqual(c2q_get_isa(), isa);
+		for (int j = 0; j < NUM_CUBICS; j++) {
+			int n = cubic2quad(&in[j * 8], 0.1, out);
+			assertEqual(n, nexpect[j]);
+			assertArraysCloseRes(out, expect[j], n * 6, 1e-9);
+		}
+	}
+
+	c2q_set_isa(initial);
+}
+
+static void test_isa_compatible()
+{
+	static double in[NUM_CUBICS * 8];
+	static double expect[NUM_CUBICS / 3][3 * C2Q_OUT_LEN];
+	static int nexpect[NUM_CUBICS / 3];
+	static double out[3 * C2Q_OUT_LEN];
+	const int initial = c2q_get_isa();
+
+	unsigned int state = 2;
+	for (int j = 0; j < NUM_CUBICS * 8; j++) {
+		in[j] = next_coordinate(&state);
+	}
+
+	assertEqual(c2q_set_isa(C2Q_ISA_SCALAR), C2Q_ISA_SCALAR);
+	for (int j = 0; j < NUM_CUBICS / 3; j++) {
+		nexpect[j] = cubic2quad_compatible(&in[j * 3 * 8], 3, 0.1, expect[j]);
+	}
+
+	// every supported level splits the masters the same way as the scalar one
+	for (int isa = C2Q_ISA_SSE2; isa <= C2Q_ISA_AVX512; isa++) {
+		if (c2q_set_isa(isa) < 0) {
+			continue;
+		}
+		for (int j = 0; j < NUM_CUBICS / 3; j++) {
+			int n = cubic2quad_compatible(&in[j * 3 * 8], 3, 0.1, out);
+			assertEqual(n, nexpect[j]);
+			for (int m = 0; m < 3; m++) {
+				assertArraysCloseRes(&out[m * C2Q_OUT_LEN], &expect[j][m * C2Q_OUT_LEN], n * 6, 1e-9);
+			}
+		}
+	}
+
+	c2q_set_isa(initial);
+}
+
+static void test_isa_unbounded()
+{
+	static double in[(NUM_CUBICS + 1) * 8] = { 0, 0, -5e6, 1e7, 3.5e7, 1e7, 3e7, 0 };
+	static unsigned char buf[1 << 20];
+	static double *expect[NUM_CUBICS + 1];
+	static int nexpect[NUM_CUBICS + 1];
+	static bool metexpect[NUM_CUBICS + 1];
+	C2QArena arena;
+	C2QAllocator allocator = { c2q_arena_alloc, &arena };
+	double *out;
+	bool met;
+	const int initial = c2q_get_isa();
+
+	// the first cubic has huge coordinates so needs more quads than
+	// cubic2quad can output
+	unsigned int state = 3;
+	for (int j = 8; j < (NUM_CUBICS + 1) * 8; j++) {
+		in[j] = next_coordinate(&state);
+	}
+
+	c2q_arena_init(&arena, buf, sizeof(buf));
+	assertEqual(c2q_set_isa(C2Q_ISA_SCALAR), C2Q_ISA_SCALAR);
+	for (int j = 0; j <= NUM_CUBICS; j++) {
+		nexpect[j] = cubic2quad_unbounded(&in[j * 8], 0.1, &allocator, &expect[j], &metexpect[j]);
+		assertTrue(nexpect[j] > 0);
+	}
+	assertTrue(nexpect[0] > C2Q_OUT_LEN / 6);
+
+	// every supported level needs the same number of quads as the scalar one
+	for (int isa = C2Q_ISA_SSE2; isa <= C2Q_ISA_AVX512; isa++) {
+		if (c2q_set_isa(isa) < 0) {
+			continue;
+		}
+		for (int j = 0; j <= NUM_CUBICS; j++) {
+			const size_t mark = arena.len;
+			int n = cubic2quad_unbounded(&in[j * 8], 0.1, &allocator, &out, &met);
+			assertEqual(n, nexpect[j]);
+			assertEqual(met, metexpect[j]);
+			assertArraysCloseRes(out, expect[j], n * 6, j == 0 ? 1e-3 : 1e-9);
+			arena.len = mark;
+		}
+	}
+
+	c2q_set_isa(initial);
+}
+
+int main() {
+	test_initial_isa();
+	test_set_isa();
+	test_isa_outputs();
+	test_isa_compatible();
+	test_isa_unbounded();
+	return 0;
+}
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#define C2Q_STATS
 #include "cubic2quad.c"
 
 #define assertTrue(a) do { \
@@ -171,6 +172,80 @@ static void test__is_approximation_close()
 	}
 }
 
+static bool is_segment_close(
+	// cubic
+	double p1x, double p1y, double c1x, double c1y, double c2x, double c2y, double p2x, double p2y,
+	double tmin, double tmax,
+	// quadratic
+	const QBezier quad,
+	double errorBound)
+{
+	Point pc[4];
+	calc_power_coefficients(
+		p_new(p1x, p1y),
+		p_new(c1x, c1y),
+		p_new(c2x, c2y),
+		p_new(p2x, p2y),
+		pc);
+	return is_segment_approximation_close(pc[0], pc[1], pc[2], pc[3], tmin, tmax,
+		quad.p1, quad.c1, quad.p2, errorBound);
+}
+
+static double distance_at(
+	double p1x, double p1y, double c1x, double c1y, double c2x, double c2y, double p2x, double p2y,
+	const QBezier quad, double t)
+{
+	Point pc[4];
+	calc_power_coefficients(
+		p_new(p1x, p1y),
+		p_new(c1x, c1y),
+		p_new(c2x, c2y),
+		p_new(p2x, p2y),
+		pc);
+	return min_distance_to_quad(calc_point(pc[0], pc[1], pc[2], pc[3], t), quad.p1, quad.c1, quad.p2);
+}
+
+static void test_is_segment_approximation_close()
+{
+	C2QStats before, after;
+
+	// short near-flat segment is accepted by its control points alone,
+	// without measuring any distances (error ~ 0.01)
+	{
+		QBezier quad = { { 0, 0 }, { 0.5, 0.001 }, { 1, 0 } };
+		c2q_get_stats(&before);
+		assertTrue(is_segment_close(0, 0, 0.34, 0.001, 0.66, 0.0012, 1, 0,
+			0, 1, quad, 0.01));
+		c2q_get_stats(&after);
+		assertEqual(after.distanceChecks, before.distanceChecks);
+	}
+
+	// error peak of the arch at t = 0.45 falls between the grid points
+	// 0.4 and 0.5, and is only found by checking halfway to them
+	{
+		QBezier quad = { { 0, 0 }, { 4, 0.2 }, { 10, 0 } };
+		double peak = distance_at(0, 0, 10.0/3, 0, 20.0/3, 0, 10, 0, quad, 0.45);
+		double grid = fmax(
+			distance_at(0, 0, 10.0/3, 0, 20.0/3, 0, 10, 0, quad, 0.4),
+			distance_at(0, 0, 10.0/3, 0, 20.0/3, 0, 10, 0, quad, 0.5));
+		assertTrue(grid < peak);
+		assertTrue(!is_segment_close(0, 0, 10.0/3, 0, 20.0/3, 0, 10, 0,
+			0, 1, quad, (grid + peak) / 2));
+	}
+
+	// error growing towards the end is caught by the last interior point
+	// (t = 0.95 of [0.5, 1]), which the grid always checks, even when
+	// nothing before it (including halfway from t = 0.9) is too far
+	{
+		QBezier quad = { { 5, 0 }, { 7.5, 0 }, { 10, 0.5 } };
+		double last = distance_at(0, 0, 10.0/3, 0, 20.0/3, 0, 10, 0, quad, 0.95);
+		double previous = distance_at(0, 0, 10.0/3, 0, 20.0/3, 0, 10, 0, quad, 0.925);
+		assertTrue(previous < last);
+		assertTrue(!is_segment_close(0, 0, 10.0/3, 0, 20.0/3, 0, 10, 0,
+			0.5, 1, quad, (previous + last) / 2));
+	}
+}
+
 static void test_cubic2quad()
 {
 	double out[MAX_DOUBLES_OUT];
@@ -244,6 +319,429 @@ static void test_cubic2quad()
 	}
 }
 
+static void test_classify_cubic()
+{
+	double out[MAX_DOUBLES_OUT];
+	C2QStats stats;
+	c2q_reset_stats();
+
+	// point
+	{
+		double in[] = { 5, 5, 5, 5, 5, 5, 5, 5 };
+		double expect[] = { 5, 5, 5, 5, 5, 5 };
+		int n = cubic2quad(in, 0.1, out);
+		assertEqual(n, 1);
+		assertArraysClose(out, expect, 6);
+	}
+
+	// line with control points moving back and forth along it
+	{
+		double in[] = { 0, 0, 20, 10, 10, 5, 30, 15 };
+		double expect[] = { 0, 0, 15, 7.5, 30, 15 };
+		int n = cubic2quad(in, 1e-8, out);
+		assertEqual(n, 1);
+		assertArraysClose(out, expect, 6);
+	}
+
+	// collinear, but overshooting the end point, is not a plain line
+	{
+		double in[] = { 0, 0, 10, 0, 40, 0, 30, 0 };
+		cubic2quad(in, 1e-8, out);
+	}
+
+	// degree elevated quadratic
+	{
+		double in[] = { 0, 0, 10, 20, 20, 20, 30, 0 };
+		double expect[] = { 0, 0, 15, 30, 30, 0 };
+		int n = cubic2quad(in, 1e-8, out);
+		assertEqual(n, 1);
+		assertArraysClose(out, expect, 6);
+	}
+
+	// cusp is split at the cusp
+	{
+		double in[] = { 0, 0, 30, 30, 0, 30, 30, 0 };
+		int n = cubic2quad(in, 1000, out);
+		assertEqual(n, 2);
+		assertCloseRes(out[4], 15.0, 1e-9);
+		assertCloseRes(out[5], 22.5, 1e-9);
+	}
+
+	c2q_get_stats(&stats);
+	assertEqual(stats.points, 1);
+	assertEqual(stats.lines, 1);
+	assertEqual(stats.quads, 1);
+	assertEqual(stats.cusps, 1);
+	assertEqual(stats.general, 1);
+
+	c2q_reset_stats();
+	c2q_get_stats(&stats);
+	assertEqual(stats.general, 0);
+}
+
+static void test_cubic2quad_transformed()
+{
+	double out[MAX_DOUBLES_OUT];
+	double expect[MAX_DOUBLES_OUT];
+
+	// identity matrix is the same as no transform
+	{
+		double in[] = { 0, 0, -5, 10, 35, 10, 30, 0 };
+		double identity[] = { 1, 0, 0, 1, 0, 0 };
+		int nexpect = cubic2quad(in, 0.1, expect);
+		int n = cubic2quad_transformed(in, identity, 0.1, out);
+		assertEqual(n, nexpect);
+		assertArraysClose(out, expect, n * 6);
+	}
+
+	// non-uniform scale and translation is the same as converting the
+	// transformed cubic
+	{
+		double in[] = { 858, -113, 739, -68, 624, -31, 533, 0 };
+		double matrix[] = { 4, 0, 0, 0.25, 10, -20 };
+		double transformed[] = {
+			858*4+10, -113*0.25-20, 739*4+10, -68*0.25-20,
+			624*4+10, -31*0.25-20, 533*4+10, 0*0.25-20 };
+		int nexpect = cubic2quad(transformed, 0.05, expect);
+		int n = cubic2quad_transformed(in, matrix, 0.05, out);
+		assertEqual(n, nexpect);
+		assertArraysCloseRes(out, expect, n * 6, 1e-9);
+	}
+
+	// error is measured after the transform, so a zoomed out curve needs
+	// fewer quads than the original
+	{
+		double in[] = { 0, 0, -50, 100, 350, 100, 300, 0 };
+		double zoomOut[] = { 0.01, 0, 0, 0.01, 0, 0 };
+		int nOrig = cubic2quad(in, 0.1, out);
+		int n = cubic2quad_transformed(in, zoomOut, 0.1, out);
+		assertTrue(n < nOrig);
+		assertCloseRes(out[n * 6 - 2], 3.0, 1e-12);
+		assertCloseRes(out[n * 6 - 1], 0.0, 1e-12);
+	}
+}
+
+static void test_cubic2quad_compatible()
+{
+	double out[3 * MAX_DOUBLES_OUT];
+	double single[MAX_DOUBLES_OUT];
+
+	// a single master is the same as cubic2quad
+	{
+		double in[] = { 0, 100, 70, 0, 30, 0, 100, 100 };
+		int nexpect = cubic2quad(in, 0.1, single);
+		int n = cubic2quad_compatible(in, 1, 0.1, out);
+		assertEqual(n, nexpect);
+		assertArraysCloseRes(out, single, n * 6, 1e-12);
+	}
+
+	// masters needing different numbers of quads all get the largest one,
+	// and stay close to their own cubic
+	{
+		double in[] = {
+			0, 0, 10, 9, 20, 11, 30, 0,
+			0, 0, -5, 10, 35, 10, 30, 0,
+			0, 0, -50, 100, 350, 100, 300, 0,
+		};
+		int nmax = 0;
+		for (int m = 0; m < 3; m++) {
+			int nm = cubic2quad(&in[m * 8], 0.1, single);
+			nmax = nm > nmax ? nm : nmax;
+		}
+		int n = cubic2quad_compatible(in, 3, 0.1, out);
+		assertEqual(n, nmax);
+		for (int m = 0; m < 3; m++) {
+			const double *cubic = &in[m * 8];
+			assertTrue(is_approximation_close(
+				cubic[0], cubic[1], cubic[2], cubic[3],
+				cubic[4], cubic[5], cubic[6], cubic[7],
+				(QBezier *)&out[m * MAX_DOUBLES_OUT], n, 0.1));
+		}
+	}
+
+	// no masters
+	{
+		double in[] = { 0, 0, 10, 10, 20, 10, 30, 0 };
+		assertEqual(cubic2quad_compatible(in, 0, 0.1, out), -1);
+	}
+
+	// masters without inflections are split at the other masters' inflections
+	{
+		double in[] = {
+			0, 100, 70, 0, 30, 0, 100, 100,
+			0, 100, 20, 0, 80, 0, 100, 100,
+		};
+		assertEqual(cubic2quad(&in[8], 1000, single), 1);
+		int n = cubic2quad_compatible(in, 2, 1000, out);
+		assertEqual(n, 3);
+		assertCloseRes(out[4], 34.33, 0.01);
+		assertCloseRes(out[10], 65.67, 0.01);
+		const double *second = &out[MAX_DOUBLES_OUT];
+		assertClose(second[0], 0.0);
+		assertClose(second[1], 100.0);
+		assertCloseRes(second[4], second[6], 1e-12);
+		assertCloseRes(second[10], second[12], 1e-12);
+		assertCloseRes(second[16], 100.0, 1e-12);
+		assertCloseRes(second[17], 100.0, 1e-12);
+	}
+}
+
+static void test_c2q_stream()
+{
+	double in[] = {
+		0, 0, 10, 10, 20, 10, 30, 0,
+		30, 0, -5, 10, 35, 10, 60, 0,
+		60, 0, 38.5, -59, 63.2, -10.7, -24.3, -30.1,
+	};
+	const double grid = 1.0 / 64;
+	unsigned char buf[1024];
+	double expect[3][MAX_DOUBLES_OUT];
+	int nexpect[3];
+	double out[MAX_DOUBLES_OUT];
+
+	// encoded splines decode to the same quads, rounded to the grid,
+	// in far less space than the raw doubles
+	C2QEncoder enc;
+	c2q_encoder_init(&enc, buf, sizeof(buf), grid);
+	int nraw = 0;
+	for (int j = 0; j < 3; j++) {
+		nexpect[j] = cubic2quad_encode(&in[j * 8], 0.1, &enc);
+		assertEqual(nexpect[j], cubic2quad(&in[j * 8], 0.1, expect[j]));
+		nraw += nexpect[j] * 6 * sizeof(double);
+	}
+	assertTrue(enc.len * 4 < (size_t)nraw);
+
+	C2QDecoder dec;
+	c2q_decoder_init(&dec, buf, enc.len, grid);
+	for (int j = 0; j < 3; j++) {
+		int n = c2q_decode(&dec, out);
+		assertEqual(n, nexpect[j]);
+		assertArraysCloseRes(out, expect[j], n * 6, grid / 2);
+	}
+	assertEqual(c2q_decode(&dec, out), 0);
+
+	// a truncated spline is not consumed until the rest of it arrives
+	c2q_decoder_init(&dec, buf, enc.len - 1, grid);
+	assertEqual(c2q_decode(&dec, out), nexpect[0]);
+	assertEqual(c2q_decode(&dec, out), nexpect[1]);
+	size_t pos = dec.pos;
+	assertEqual(c2q_decode(&dec, out), C2Q_DECODE_INCOMPLETE);
+	assertEqual(dec.pos, pos);
+	dec.len = enc.len;
+	assertEqual(c2q_decode(&dec, out), nexpect[2]);
+	assertArraysCloseRes(out, expect[2], nexpect[2] * 6, grid / 2);
+
+	// nothing is written when the buffer is too small
+	{
+		unsigned char small[12];
+		c2q_encoder_init(&enc, small, sizeof(small), grid);
+		assertEqual(cubic2quad_encode(&in[0], 0.1, &enc), 1);
+		size_t len = enc.len;
+		assertEqual(cubic2quad_encode(&in[16], 0.1, &enc), -1);
+		assertEqual(enc.len, len);
+	}
+
+	// nothing is written for a bad grid or points that can't be encoded
+	{
+		double quad[] = { 0, 0, 15, 15, 30, 0 };
+		c2q_encoder_init(&enc, buf, sizeof(buf), 0);
+		assertEqual(c2q_encode(&enc, quad, 1), -1);
+		c2q_encoder_init(&enc, buf, sizeof(buf), -grid);
+		assertEqual(c2q_encode(&enc, quad, 1), -1);
+		c2q_encoder_init(&enc, buf, sizeof(buf), NAN);
+		assertEqual(c2q_encode(&enc, quad, 1), -1);
+
+		c2q_encoder_init(&enc, buf, sizeof(buf), grid);
+		quad[2] = NAN;
+		assertEqual(c2q_encode(&enc, quad, 1), -1);
+		quad[2] = INFINITY;
+		assertEqual(c2q_encode(&enc, quad, 1), -1);
+		quad[2] = 1e30;
+		assertEqual(c2q_encode(&enc, quad, 1), -1);
+		assertEqual(enc.len, 0);
+	}
+
+	// malformed streams are told apart from incomplete ones
+	{
+		// 0 quads
+		const unsigned char zero[] = { 0x00, 0x00, 0x00 };
+		c2q_decoder_init(&dec, zero, sizeof(zero), grid);
+		assertEqual(c2q_decode(&dec, out), C2Q_DECODE_MALFORMED);
+		assertEqual(dec.pos, 0);
+
+		// 25 quads, more than cubic2quad ever outputs
+		const unsigned char tooMany[] = { 50, 0x00, 0x00 };
+		c2q_decoder_init(&dec, tooMany, sizeof(tooMany), grid);
+		assertEqual(c2q_decode(&dec, out), C2Q_DECODE_MALFORMED);
+
+		// varint longer than 64 bits
+		const unsigned char longVarint[] = { 0x02,
+			0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x7f };
+		c2q_decoder_init(&dec, longVarint, sizeof(longVarint), grid);
+		assertEqual(c2q_decode(&dec, out), C2Q_DECODE_MALFORMED);
+
+		// point too far out to have been encoded
+		const unsigned char farPoint[] = { 0x02,
+			0xfe, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01 };
+		c2q_decoder_init(&dec, farPoint, sizeof(farPoint), grid);
+		assertEqual(c2q_decode(&dec, out), C2Q_DECODE_MALFORMED);
+
+		// the same varint cut short is only incomplete
+		c2q_decoder_init(&dec, farPoint, 5, grid);
+		assertEqual(c2q_decode(&dec, out), C2Q_DECODE_INCOMPLETE);
+	}
+}
+
+static void test_cubic2quad_binned()
+{
+	double out[MAX_DOUBLES_OUT];
+	double bounds[MAX_QUADS_OUT * 4];
+	int tiles[4 * 4 * 8];
+	int counts[4 * 4];
+	C2QTileGrid grid;
+
+	// 4x4 grid of 10x10 tiles covering (0, 0) to (40, 40)
+	c2q_tile_grid_init(&grid, 0, 0, 10, 10, 4, 4, tiles, counts, 8);
+
+	// bounds include the extremum of the quad, not just its end points
+	{
+		double in[] = { 0, 0, 10, 20, 20, 20, 30, 0 };
+		double expect[] = { 0, 0, 30, 15 };
+		int n = cubic2quad_binned(in, 0.1, out, bounds, &grid);
+		assertEqual(n, 1);
+		assertArraysClose(bounds, expect, 4);
+		// rows 0 and 1 of columns 0 to 3
+		for (int tile = 0; tile < 16; tile++) {
+			assertEqual(counts[tile], tile < 8 ? 1 : 0);
+		}
+		assertEqual(tiles[0], 0);
+		assertEqual(tiles[7 * 8], 0);
+	}
+
+	// quads are numbered on from the previous call, and only the tiles
+	// within the grid get them
+	{
+		double in[] = { 35, 35, 40, 40, 45, 45, 50, 50 };
+		int n = cubic2quad_binned(in, 0.1, out, NULL, &grid);
+		assertEqual(n, 1);
+		assertEqual(grid.quadCount, 2);
+		assertEqual(counts[15], 1);
+		assertEqual(tiles[15 * 8], 1);
+		assertEqual(counts[14], 0);
+	}
+
+	// counts go past the capacity when a tile overflows
+	{
+		double in[] = { 1, 1, 2, 2, 3, 3, 4, 4 };
+		for (int i = 0; i < 9; i++) {
+			cubic2quad_binned(in, 0.1, out, NULL, &grid);
+		}
+		assertEqual(counts[0], 10);
+		assertEqual(tiles[7], 8);
+	}
+}
+
+static void test_cubic2quad_unbounded()
+{
+	static unsigned char buf[1 << 16];
+	C2QArena arena;
+	C2QAllocator allocator = { c2q_arena_alloc, &arena };
+	c2q_arena_init(&arena, buf, sizeof(buf));
+	double expect[MAX_DOUBLES_OUT];
+	double *out;
+	bool met;
+
+	// same as cubic2quad when it meets the bound
+	{
+		double in[] = { 858, -113, 739, -68, 624, -31, 533, 0 };
+		int nexpect = cubic2quad(in, 0.005, expect);
+		int n = cubic2quad_unbounded(in, 0.005, &allocator, &out, &met);
+		assertEqual(n, nexpect);
+		assertTrue(met);
+		assertArraysClose(out, expect, n * 6);
+	}
+
+	// huge coordinates need more than cubic2quad's maximum of quads
+	{
+		double in[] = { 0, 0, -5e6, 1e7, 3.5e7, 1e7, 3e7, 0 };
+		int nlimited = cubic2quad(in, 0.1, expect);
+		assertTrue(!is_approximation_close(
+			in[0], in[1], in[2], in[3], in[4], in[5], in[6], in[7],
+			(QBezier *)expect, nlimited, 0.1));
+		int n = cubic2quad_unbounded(in, 0.1, &allocator, &out, &met);
+		assertTrue(n > nlimited);
+		assertTrue(met);
+		assertTrue(is_approximation_close(
+			in[0], in[1], in[2], in[3], in[4], in[5], in[6], in[7],
+			(QBezier *)out, n, 0.1));
+		assertClose(out[0], 0.0);
+		assertCloseRes(out[n * 6 - 2], 3e7, 1e-6);
+	}
+
+	// nothing is returned when the allocator runs out
+	{
+		double in[] = { 0, 0, -5, 10, 35, 10, 30, 0 };
+		unsigned char small[sizeof(double) * 6];
+		c2q_arena_init(&arena, small, sizeof(small));
+		out = NULL;
+		assertEqual(cubic2quad_unbounded(in, 0.1, &allocator, &out, &met), -1);
+		assertTrue(out == NULL);
+	}
+}
+
+static void test_c2q_path()
+{
+	double in[] = {
+		0, 0, 10, 10, 20, 10, 30, 0,
+		30, 0, -5, 10, 35, 10, 60, 0,
+		60, 0, 70, 10, 80, 20, 90, 30,
+	};
+	C2QPathCubic cubics[3];
+	C2QPath path;
+	int changed[3];
+	double out[MAX_DOUBLES_OUT];
+
+	// first update converts everything
+	c2q_path_init(&path, cubics, 3, in, 0.1);
+	int n = c2q_path_update(&path, changed);
+	assertEqual(n, 3);
+	assertEqual(changed[0], 0);
+	assertEqual(changed[1], 1);
+	assertEqual(changed[2], 2);
+	for (int j = 0; j < 3; j++) {
+		int nexpect = cubic2quad(&in[j * 8], 0.1, out);
+		assertEqual(cubics[j].count, nexpect);
+		assertArraysClose(cubics[j].out, out, nexpect * 6);
+	}
+
+	// nothing changed
+	n = c2q_path_update(&path, changed);
+	assertEqual(n, 0);
+
+	// setting the same cubic again doesn't mark it dirty
+	c2q_path_set(&path, 1, &in[8]);
+	n = c2q_path_update(&path, NULL);
+	assertEqual(n, 0);
+
+	// moving the point shared by the last two cubics reconverts only them
+	{
+		double second[] = { 30, 0, -5, 10, 35, 10, 65, 5 };
+		double third[] = { 65, 5, 70, 10, 80, 20, 90, 30 };
+		c2q_path_set(&path, 1, second);
+		c2q_path_set(&path, 2, third);
+		n = c2q_path_update(&path, changed);
+		assertEqual(n, 2);
+		assertEqual(changed[0], 1);
+		assertEqual(changed[1], 2);
+		int nexpect = cubic2quad(second, 0.1, out);
+		assertEqual(cubics[1].count, nexpect);
+		assertArraysClose(cubics[1].out, out, nexpect * 6);
+		nexpect = cubic2quad(third, 0.1, out);
+		assertEqual(cubics[2].count, nexpect);
+		assertArraysClose(cubics[2].out, out, nexpect * 6);
+	}
+}
+
 static void test_compare_to_original()
 {
 	/*
@@ -312,7 +810,15 @@ console.log(`const double expect[] = { ${out.join()} };`);
 int main() {
 	test_cubic_equation_solver();
 	test__is_approximation_close();
+	test_is_segment_approximation_close();
 	test_cubic2quad();
+	test_classify_cubic();
+	test_cubic2quad_transformed();
+	test_cubic2quad_compatible();
+	test_c2q_stream();
+	test_cubic2quad_binned();
+	test_cubic2quad_unbounded();
+	test_c2q_path();
 	test_compare_to_original();
 	return 0;
 }